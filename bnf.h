@@ -1,29 +1,169 @@
+#pragma once
+
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <stack>
 #include <memory>
 #include <optional>
 #include <limits>
 #include <functional>
+#include <memory_resource>
+#include <new>
+#include <array>
+#include <bitset>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
 
 namespace bnf
 {
     struct rule_base; // Forward declaration
     struct rule_ref;  // Forward declaration
+    struct token;     // Forward declaration
+
+    // Thrown by counting_resource when an allocation would exceed its limit
+    struct memory_limit_exceeded : public std::bad_alloc
+    {
+        const char *what() const noexcept override
+        {
+            return "bnf: memory limit exceeded";
+        }
+    };
+
+    // Memory resource wrapper that counts bytes and enforces an upper limit
+    struct counting_resource : public std::pmr::memory_resource
+    {
+        size_t limit;
+        size_t allocated = 0;
+        size_t peak = 0;
+        size_t allocations = 0;
+        std::pmr::memory_resource *upstream;
+
+        counting_resource(size_t in_limit = std::numeric_limits<size_t>::max(),
+                          std::pmr::memory_resource *in_upstream = std::pmr::get_default_resource()) : limit(in_limit),
+                                                                                                       upstream(in_upstream) {}
+        virtual ~counting_resource() = default;
+
+    protected:
+        void *do_allocate(size_t bytes, size_t alignment) override
+        {
+            if (bytes > limit - allocated)
+                throw memory_limit_exceeded();
+            void *p = upstream->allocate(bytes, alignment);
+            allocated += bytes;
+            allocations++;
+            if (allocated > peak)
+                peak = allocated;
+            return p;
+        }
 
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override
+        {
+            upstream->deallocate(p, bytes, alignment);
+            allocated -= bytes;
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    using monotonic_resource = std::pmr::monotonic_buffer_resource;
+    using pool_resource = std::pmr::unsynchronized_pool_resource;
+
+    inline std::pmr::memory_resource *&scoped_resource()
+    {
+        thread_local std::pmr::memory_resource *resource = nullptr;
+        return resource;
+    }
+
+    // Resource used by the matchers of the current thread
+    inline std::pmr::memory_resource *current_resource()
+    {
+        auto resource = scoped_resource();
+        return resource ? resource : std::pmr::get_default_resource();
+    }
+
+    // Route all the allocations made while matching through a resource
+    struct memory_scope
+    {
+        std::pmr::memory_resource *previous;
+
+        memory_scope(std::pmr::memory_resource *resource) : previous(scoped_resource())
+        {
+            scoped_resource() = resource;
+        }
+        ~memory_scope()
+        {
+            scoped_resource() = previous;
+        }
+
+        memory_scope(const memory_scope &) = delete;
+        memory_scope &operator=(const memory_scope &) = delete;
+    };
+
+    struct token_deleter
+    {
+        std::pmr::memory_resource *resource = nullptr;
+
+        void operator()(token *t) const; // declaration
+    };
+
+    using token_ptr = std::unique_ptr<token, token_deleter>;
+
+    // The children are only appended through add_child, which links them to
+    // their parent: the iterators rely on these links instead of a stack
     struct token
     {
         std::streampos start_pos;
         std::streampos end_pos;
         rule_base *rule;
-        std::vector<std::unique_ptr<token>> children;
 
-        static std::unique_ptr<token> null_token()
+        token() = default;
+        token(std::pmr::memory_resource *resource) : m_children(resource) {}
+
+        static token_ptr null_token()
         {
-            return std::unique_ptr<token>();
+            return token_ptr();
         }
 
+        static token_ptr create(std::pmr::memory_resource *resource)
+        {
+            std::pmr::polymorphic_allocator<token> alloc(resource);
+            token *t = alloc.allocate(1);
+            new (t) token(resource);
+            return token_ptr(t, token_deleter{resource});
+        }
+
+        void add_child(token_ptr child)
+        {
+            child->m_parent = this;
+            child->m_index = m_children.size();
+            m_children.emplace_back(std::move(child));
+        }
+
+        const std::pmr::vector<token_ptr> &children() const { return m_children; }
+        token *parent() const { return m_parent; }
+        size_t index() const { return m_index; } // Position in the parent children
+
+        // Next sibling, nullptr for the last child
+        token *next_sibling() const
+        {
+            if (m_parent && m_index + 1 < m_parent->m_children.size())
+                return m_parent->m_children[m_index + 1].get();
+            return nullptr;
+        }
+
+        // Pre-order iterator over the subtree rooted at the starting token,
+        // the parent links are used instead of a stack
         struct iterator
         {
             using iterator_category = std::forward_iterator_tag;
@@ -32,13 +172,7 @@ namespace bnf
             using pointer = token *;
             using reference = token &;
 
-            struct stack_data
-            {
-                pointer node_ptr;
-                size_t index;
-            };
-
-            iterator(pointer ptr) : m_ptr(ptr), child_index(0) {}
+            iterator(pointer ptr) : m_root(ptr), m_ptr(ptr) {}
 
             reference operator*() const { return *m_ptr; }
             pointer operator->() { return m_ptr; }
@@ -49,75 +183,142 @@ namespace bnf
                     return *this;
                 }
 
-                if (!m_ptr->children.empty())
+                if (!m_ptr->children().empty())
                 {
-                    // Store current status in the stack
-                    node_stack.push({m_ptr, child_index});
                     // Go to first child
-                    child_index = 0;
-                    m_ptr = m_ptr->children[child_index].get();
+                    m_ptr = m_ptr->children().front().get();
+                    return *this;
                 }
-                else
+                return skip_children();
+            }
+
+            iterator operator++(int)
+            {
+                iterator tmp = *this;
+                ++(*this);
+                return tmp;
+            }
+
+            // Move to the next node that is not a descendant of the current one
+            iterator &skip_children()
+            {
+                // Move up until a node with a next sibling
+                while (m_ptr != nullptr && m_ptr != m_root)
                 {
-                    // Move up in the stack and go to next child
-                    do
+                    if (auto next = m_ptr->next_sibling())
                     {
-                        // Restore state from stack
-                        auto data = node_stack.top();
-                        node_stack.pop();
-                        child_index = data.index;
-                        m_ptr = data.node_ptr;
-                    } while (!node_stack.empty() && child_index == (m_ptr->children.size() - 1));
-
-                    if (child_index < (m_ptr->children.size() - 1))
-                    {
-                        // Move next and store status
-                        child_index++;
-                        node_stack.push({m_ptr, child_index});
-                        // Next node
-                        m_ptr = m_ptr->children[child_index].get();
-                        child_index = 0;
-                    }
-                    else
-                    {
-                        m_ptr = nullptr;
+                        m_ptr = next;
+                        return *this;
                     }
+                    m_ptr = m_ptr->parent();
                 }
+                m_ptr = nullptr;
                 return *this;
             }
 
-            iterator operator++(int)
+            friend bool operator==(const iterator &a, const iterator &b) { return a.m_ptr == b.m_ptr; };
+
+            friend bool operator!=(const iterator &a, const iterator &b) { return a.m_ptr != b.m_ptr; };
+
+        private:
+            pointer m_root;
+            pointer m_ptr;
+        };
+
+        // Post-order iterator, children are visited before their parent
+        struct postorder_iterator
+        {
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+            using value_type = token;
+            using pointer = token *;
+            using reference = token &;
+
+            postorder_iterator(pointer ptr) : m_root(ptr), m_ptr(ptr ? first_leaf(ptr) : nullptr) {}
+
+            reference operator*() const { return *m_ptr; }
+            pointer operator->() { return m_ptr; }
+            postorder_iterator &operator++()
             {
-                iterator tmp = *this;
+                if (m_ptr == nullptr || m_ptr == m_root)
+                {
+                    m_ptr = nullptr;
+                    return *this;
+                }
+
+                if (auto next = m_ptr->next_sibling())
+                    m_ptr = first_leaf(next);
+                else
+                    m_ptr = m_ptr->parent();
+                return *this;
+            }
+
+            postorder_iterator operator++(int)
+            {
+                postorder_iterator tmp = *this;
                 ++(*this);
                 return tmp;
             }
 
-            friend bool operator==(const iterator &a, const iterator &b) { return a.m_ptr == b.m_ptr; };
+            friend bool operator==(const postorder_iterator &a, const postorder_iterator &b) { return a.m_ptr == b.m_ptr; };
 
-            friend bool operator!=(const iterator &a, const iterator &b) { return a.m_ptr != b.m_ptr; };
+            friend bool operator!=(const postorder_iterator &a, const postorder_iterator &b) { return a.m_ptr != b.m_ptr; };
 
         private:
+            pointer m_root;
             pointer m_ptr;
-            size_t child_index;
-            std::stack<stack_data> node_stack;
+
+            static pointer first_leaf(pointer ptr)
+            {
+                while (!ptr->children().empty())
+                    ptr = ptr->children().front().get();
+                return ptr;
+            }
+        };
+
+        template <typename TIterator>
+        struct range
+        {
+            TIterator first;
+            TIterator last;
+
+            TIterator begin() const { return first; }
+            TIterator end() const { return last; }
         };
 
         iterator begin() { return iterator(this); }
         iterator end() { return iterator(nullptr); }
+
+        range<iterator> preorder() { return {iterator(this), iterator(nullptr)}; }
+        range<postorder_iterator> postorder() { return {postorder_iterator(this), postorder_iterator(nullptr)}; }
+
+    private:
+        std::pmr::vector<token_ptr> m_children;
+        token *m_parent = nullptr;
+        size_t m_index = 0;
     };
 
+    inline void token_deleter::operator()(token *t) const // Implementation
+    {
+        std::pmr::polymorphic_allocator<token> alloc(resource);
+        t->~token();
+        alloc.deallocate(t, 1);
+    }
+
     struct rule_base
     {
         rule_base() = default;
         virtual ~rule_base() = default;
 
-        virtual std::unique_ptr<token> match(std::istream &is) = 0;
+        virtual token_ptr match(std::istream &is) = 0;
         virtual std::string to_string() = 0;
 
-        virtual std::unique_ptr<token> match_begin(std::istream &is)
+        // Append the rules referenced by this rule
+        virtual void sub_rules(std::vector<rule_base *> &) {}
+
+        virtual token_ptr match_begin(std::istream &is)
         {
-            auto t = std::make_unique<token>();
+            auto t = token::create(current_resource());
             t->start_pos = is.tellg();
             t->rule = this;
 
@@ -151,6 +352,10 @@ namespace bnf
         virtual ~named_rule() = default;
     };
 
+    // Match a named rule on the scanner of the current thread, nullopt when
+    // the rule or the stream position are not handled by the scanner
+    inline std::optional<token_ptr> scanner_match(named_rule *r, std::istream &is); // declaration
+
     struct rule_move_default
     {
         static std::unique_ptr<rule_base> move(std::unique_ptr<rule_base> in_child)
@@ -172,12 +377,15 @@ namespace bnf
 
         virtual ~rule() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
+            if (auto st = scanner_match(this, is))
+                return std::move(*st);
+
             auto t = match_begin(is);
             if (auto tc = child->match(is))
             {
-                t->children.emplace_back(std::move(tc));
+                t->add_child(std::move(tc));
                 match_passed(is, t.get());
                 return t;
             }
@@ -189,6 +397,12 @@ namespace bnf
         {
             return name + " := " + child->to_string() + "\n";
         }
+
+        void sub_rules(std::vector<rule_base *> &out) override
+        {
+            if (child)
+                out.push_back(child.get());
+        }
     };
 
     struct rule_ref : public rule_base
@@ -200,12 +414,12 @@ namespace bnf
 
         virtual ~rule_ref() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
             auto t = match_begin(is);
             if (auto tc = child->match(is))
             {
-                t->children.emplace_back(std::move(tc));
+                t->add_child(std::move(tc));
                 match_passed(is, t.get());
                 return t;
             }
@@ -222,6 +436,12 @@ namespace bnf
             return child->to_string();
         }
 
+        void sub_rules(std::vector<rule_base *> &out) override
+        {
+            if (child)
+                out.push_back(child);
+        }
+
         rule_ref &operator=(rule_base *rhs)
         {
             child = rhs;
@@ -241,14 +461,14 @@ namespace bnf
         literal(const std::string &in_text) : text(in_text) {}
         virtual ~literal() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
             if (is.eof())
                 return token::null_token();
             auto t = match_begin(is);
-            std::string buf(text.size(), '\0');
+            std::pmr::string buf(text.size(), '\0', current_resource());
             is.read(&buf[0], text.size());
-            if (!is.good() || buf != text)
+            if (!is.good() || std::string_view(buf) != text)
             {
                 is.clear();
                 match_fail(is, t.get());
@@ -274,7 +494,7 @@ namespace bnf
         char_range(const char in_low, const char in_high) : low(in_low), high(in_high) {}
         virtual ~char_range() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
             if (is.eof())
                 return token::null_token();
@@ -304,7 +524,7 @@ namespace bnf
         char_set(const std::string &in_cset) : cset(in_cset) {}
         virtual ~char_set() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
             if (is.eof())
                 return token::null_token();
@@ -336,7 +556,7 @@ namespace bnf
         {
         }
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
 
             auto t = match_begin(is);
@@ -346,7 +566,7 @@ namespace bnf
                 auto tc = c->match(is);
                 if (tc)
                 {
-                    t->children.emplace_back(std::move(tc));
+                    t->add_child(std::move(tc));
                     match_passed(is, t.get());
                     return t;
                 }
@@ -369,6 +589,12 @@ namespace bnf
             ret = ret + ")";
             return ret;
         }
+
+        void sub_rules(std::vector<rule_base *> &out) override
+        {
+            for (auto &c : children)
+                out.push_back(c.get());
+        }
     };
 
     struct sequence : public rule_base
@@ -380,7 +606,7 @@ namespace bnf
         }
         virtual ~sequence() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
 
             auto t = match_begin(is);
@@ -393,7 +619,7 @@ namespace bnf
                     match_fail(is, t.get());
                     return token::null_token();
                 }
-                t->children.emplace_back(std::move(tc));
+                t->add_child(std::move(tc));
             }
 
             match_passed(is, t.get());
@@ -413,6 +639,12 @@ namespace bnf
             ret = ret + ")";
             return ret;
         }
+
+        void sub_rules(std::vector<rule_base *> &out) override
+        {
+            for (auto &c : children)
+                out.push_back(c.get());
+        }
     };
 
     struct range_any
@@ -442,7 +674,7 @@ namespace bnf
         repeat(std::unique_ptr<rule_base> in_rule_base) : child(std::move(in_rule_base)) {}
         virtual ~repeat() = default;
 
-        std::unique_ptr<token> match(std::istream &is) override
+        token_ptr match(std::istream &is) override
         {
             auto t = match_begin(is);
             size_t count = 0;
@@ -461,7 +693,7 @@ namespace bnf
                 }
                 else
                 {
-                    t->children.emplace_back(std::move(tc));
+                    t->add_child(std::move(tc));
                 }
                 count++;
             }
@@ -482,6 +714,11 @@ namespace bnf
 
             return ret;
         }
+
+        void sub_rules(std::vector<rule_base *> &out) override
+        {
+            out.push_back(child.get());
+        }
     };
 
     using any = repeat<range_any>;
@@ -533,4 +770,544 @@ namespace bnf
 
     using rulea = rule<>;
     using rulew = rule<skip_whitespace>;
+
+    // Match a rule allocating every token from resource, a match that exceeds
+    // the resource limit is aborted and the stream restored
+    inline token_ptr parse(rule_base &r, std::istream &is, std::pmr::memory_resource *resource)
+    {
+        memory_scope scope(resource);
+        auto start_pos = is.tellg();
+        try
+        {
+            return r.match(is);
+        }
+        catch (const memory_limit_exceeded &)
+        {
+            is.clear();
+            is.seekg(start_pos);
+            return token::null_token();
+        }
+    }
+
+    struct lexeme
+    {
+        std::streamoff skip_pos;  // Start of the whitespace before the lexeme
+        std::streamoff start_pos;
+        std::streamoff end_pos;
+        std::streamoff trail_pos; // End of the whitespace after the lexeme
+        named_rule *rule;
+    };
+
+    // Lexer stage for terminal rules: the named rules made only of literal,
+    // char_range, char_set and repeats of them are compiled into a single DFA
+    // and the input is split once into lexemes (longest match, ties resolved
+    // by rule order). While a scanner is active (see scanner_scope) matching
+    // one of these rules is a lookup in the lexeme array; the resulting token
+    // has no children.
+    struct scanner
+    {
+        struct entry
+        {
+            named_rule *rule;
+            rule_base *body;
+            bool skip_whitespace;
+            bool nullable = false; // The body matches the empty input
+        };
+
+        std::vector<entry> entries;
+        std::unordered_map<rule_base *, size_t> index;
+        std::bitset<256> skip;
+        std::vector<std::array<int, 256>> table; // DFA transitions, -1 is the dead state
+        std::vector<int> accept;                 // Entry accepted by each DFA state, -1 if none
+        std::optional<std::pmr::vector<lexeme>> lexemes; // Empty before scan and after release
+        size_t cursor = 0;
+
+        scanner(const std::vector<named_rule *> &rules)
+        {
+            skip = char_class(whitespace->child.get());
+            for (auto r : rules)
+            {
+                bool skip_whitespace = false;
+                if (auto body = terminal_body(r, skip_whitespace))
+                {
+                    index[r] = entries.size();
+                    entries.push_back({r, body, skip_whitespace});
+                }
+            }
+            compile();
+        }
+
+        scanner(rule_base *root) : scanner(collect(root)) {}
+
+        // Named rules reachable from root, in discovery order
+        static std::vector<named_rule *> collect(rule_base *root)
+        {
+            std::vector<named_rule *> ret;
+            std::unordered_set<rule_base *> visited;
+            std::vector<rule_base *> pending({root});
+            while (!pending.empty())
+            {
+                auto r = pending.back();
+                pending.pop_back();
+                if (!r || !visited.insert(r).second)
+                    continue;
+                if (auto nr = dynamic_cast<named_rule *>(r))
+                    ret.push_back(nr);
+                std::vector<rule_base *> sub;
+                r->sub_rules(sub);
+                pending.insert(pending.end(), sub.rbegin(), sub.rend());
+            }
+            return ret;
+        }
+
+        // Split the input in lexemes, the stream position is left unchanged.
+        // Scanning stops at the first character no rule matches. The input
+        // copy and the lexemes are allocated from resource (by default the
+        // current one), and the lexemes are kept there: call release() before
+        // resource is destroyed, the scanner must not outlive it while
+        // holding lexemes. When the resource limit is exceeded no lexeme is
+        // kept and false is returned.
+        bool scan(std::istream &is, std::pmr::memory_resource *resource = current_resource())
+        {
+            release();
+            lexemes.emplace(resource);
+
+            std::streamoff base = is.tellg();
+            try
+            {
+                std::pmr::string text(resource);
+                text.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+                is.clear();
+                is.seekg(base);
+                split(text, base);
+            }
+            catch (const memory_limit_exceeded &)
+            {
+                release();
+                is.clear();
+                is.seekg(base);
+                return false;
+            }
+            return true;
+        }
+
+        // Free the lexemes, giving their memory back to the scan resource
+        void release()
+        {
+            lexemes.reset();
+            cursor = 0;
+        }
+
+        std::optional<token_ptr> match(named_rule *r, std::istream &is)
+        {
+            auto it = index.find(r);
+            if (it == index.end())
+                return std::nullopt;
+            const entry &e = entries[it->second];
+
+            auto l = find(is.tellg(), e.skip_whitespace);
+            if (!l)
+                return std::nullopt;
+            if (l->rule != r && !e.nullable)
+                return token::null_token();
+
+            // A lexeme of another rule leaves an empty match to a nullable rule
+            auto t = r->match_begin(is);
+            if (l->rule != r)
+                is.seekg(l->start_pos);
+            else
+                is.seekg(e.skip_whitespace ? l->trail_pos : l->end_pos);
+            r->match_passed(is, t.get());
+            return t;
+        }
+
+    private:
+        void split(const std::pmr::string &text, std::streamoff base)
+        {
+
+            size_t pos = 0;
+            while (true)
+            {
+                size_t skip_pos = pos;
+                while (pos < text.size() && skip[static_cast<unsigned char>(text[pos])])
+                    pos++;
+                if (!lexemes->empty())
+                    lexemes->back().trail_pos = base + pos;
+                if (pos == text.size())
+                    break;
+
+                int state = 0;
+                int last_accept = -1;
+                size_t last_end = pos;
+                for (size_t i = pos; i < text.size(); i++)
+                {
+                    state = table[state][static_cast<unsigned char>(text[i])];
+                    if (state < 0)
+                        break;
+                    if (accept[state] >= 0)
+                    {
+                        last_accept = accept[state];
+                        last_end = i + 1;
+                    }
+                }
+                if (last_accept < 0)
+                    break;
+
+                std::streamoff start_pos = base + pos;
+                std::streamoff end_pos = base + last_end;
+                lexemes->push_back({base + static_cast<std::streamoff>(skip_pos), start_pos, end_pos, end_pos,
+                                   entries[last_accept].rule});
+                pos = last_end;
+            }
+        }
+
+        struct nfa_state
+        {
+            std::bitset<256> cset;
+            int next = -1;
+            std::vector<int> epsilon;
+            int accept = -1;
+        };
+
+        struct fragment
+        {
+            int start;
+            int end;
+        };
+
+        std::vector<nfa_state> nfa;
+
+        // Terminals the DFA can compile, other terminal_rule subclasses are
+        // left to direct matching
+        static bool is_scannable(rule_base *r)
+        {
+            return dynamic_cast<literal *>(r) || dynamic_cast<char_range *>(r) || dynamic_cast<char_set *>(r);
+        }
+
+        static bool is_terminal(rule_base *r)
+        {
+            if (is_scannable(r))
+                return true;
+            if (auto rp = dynamic_cast<any *>(r))
+                return is_scannable(rp->child.get());
+            if (auto rp = dynamic_cast<opt *>(r))
+                return is_scannable(rp->child.get());
+            if (auto rp = dynamic_cast<more *>(r))
+                return is_scannable(rp->child.get());
+            return false;
+        }
+
+        static bool is_whitespace_ref(rule_base *r)
+        {
+            auto ref = dynamic_cast<rule_ref *>(r);
+            return ref && ref->child == whitespace.get();
+        }
+
+        // Body of a terminal-only named rule, unwrapping the skip_whitespace sequence
+        static rule_base *terminal_body(named_rule *r, bool &skip_whitespace)
+        {
+            std::vector<rule_base *> sub;
+            r->sub_rules(sub);
+            if (sub.size() != 1)
+                return nullptr;
+
+            rule_base *body = sub[0];
+            skip_whitespace = false;
+            if (auto seq = dynamic_cast<sequence *>(body))
+            {
+                if (seq->children.size() == 3 &&
+                    is_whitespace_ref(seq->children[0].get()) &&
+                    is_whitespace_ref(seq->children[2].get()))
+                {
+                    body = seq->children[1].get();
+                    skip_whitespace = true;
+                }
+            }
+            return is_terminal(body) ? body : nullptr;
+        }
+
+        // Characters matched by a single character rule
+        static std::bitset<256> char_class(rule_base *r)
+        {
+            std::bitset<256> ret;
+            for (int i = 0; i < 256; i++)
+            {
+                char c = static_cast<char>(i);
+                if (auto cr = dynamic_cast<char_range *>(r))
+                    ret[i] = c >= cr->low && c <= cr->high;
+                else if (auto cs = dynamic_cast<char_set *>(r))
+                    ret[i] = cs->cset.find(c) != std::string::npos;
+            }
+            return ret;
+        }
+
+        int add_state()
+        {
+            nfa.emplace_back();
+            return static_cast<int>(nfa.size() - 1);
+        }
+
+        fragment build(rule_base *r)
+        {
+            int start = add_state();
+            if (auto l = dynamic_cast<literal *>(r))
+            {
+                int end = start;
+                for (char c : l->text)
+                {
+                    int next = add_state();
+                    nfa[end].cset[static_cast<unsigned char>(c)] = true;
+                    nfa[end].next = next;
+                    end = next;
+                }
+                return {start, end};
+            }
+            if (dynamic_cast<char_range *>(r) || dynamic_cast<char_set *>(r))
+            {
+                int end = add_state();
+                nfa[start].cset = char_class(r);
+                nfa[start].next = end;
+                return {start, end};
+            }
+
+            std::vector<rule_base *> sub;
+            r->sub_rules(sub);
+            fragment f = build(sub[0]);
+            int end = add_state();
+            nfa[start].epsilon.push_back(f.start);
+            nfa[f.end].epsilon.push_back(end);
+            if (!dynamic_cast<more *>(r))
+                nfa[start].epsilon.push_back(end); // any, opt: zero occurrences
+            if (!dynamic_cast<opt *>(r))
+                nfa[f.end].epsilon.push_back(f.start); // any, more: repeat
+            return {start, end};
+        }
+
+        void closure(std::vector<int> &states)
+        {
+            std::vector<int> pending(states);
+            while (!pending.empty())
+            {
+                int s = pending.back();
+                pending.pop_back();
+                for (int e : nfa[s].epsilon)
+                {
+                    if (std::find(states.begin(), states.end(), e) == states.end())
+                    {
+                        states.push_back(e);
+                        pending.push_back(e);
+                    }
+                }
+            }
+            std::sort(states.begin(), states.end());
+        }
+
+        void compile()
+        {
+            int root = add_state();
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                fragment f = build(entries[i].body);
+                nfa[root].epsilon.push_back(f.start);
+                nfa[f.end].accept = static_cast<int>(i);
+
+                std::vector<int> empty({f.start});
+                closure(empty);
+                entries[i].nullable = std::binary_search(empty.begin(), empty.end(), f.end);
+            }
+
+            // Subset construction
+            std::map<std::vector<int>, int> dfa_states;
+            std::vector<std::vector<int>> pending;
+            auto add_dfa_state = [&](std::vector<int> states) {
+                auto it = dfa_states.find(states);
+                if (it != dfa_states.end())
+                    return it->second;
+                int id = static_cast<int>(table.size());
+                int acc = -1;
+                for (int s : states)
+                {
+                    if (nfa[s].accept >= 0 && (acc < 0 || nfa[s].accept < acc))
+                        acc = nfa[s].accept;
+                }
+                table.emplace_back();
+                table.back().fill(-1);
+                accept.push_back(acc);
+                dfa_states.emplace(states, id);
+                pending.push_back(std::move(states));
+                return id;
+            };
+
+            std::vector<int> start({root});
+            closure(start);
+            add_dfa_state(start);
+            while (!pending.empty())
+            {
+                auto states = std::move(pending.back());
+                pending.pop_back();
+                int id = dfa_states[states];
+                for (int c = 0; c < 256; c++)
+                {
+                    std::vector<int> next;
+                    for (int s : states)
+                    {
+                        if (nfa[s].next >= 0 && nfa[s].cset[c] &&
+                            std::find(next.begin(), next.end(), nfa[s].next) == next.end())
+                            next.push_back(nfa[s].next);
+                    }
+                    if (next.empty())
+                        continue;
+                    closure(next);
+                    table[id][c] = add_dfa_state(std::move(next));
+                }
+            }
+            nfa.clear();
+        }
+
+        // Lexeme a rule starting at pos can match: a rule skipping whitespace
+        // can start anywhere in the whitespace before the lexeme
+        const lexeme *find(std::streamoff pos, bool skip_whitespace)
+        {
+            auto covers = [&](const lexeme &l) {
+                return skip_whitespace ? (l.skip_pos <= pos && pos <= l.start_pos) : pos == l.start_pos;
+            };
+            if (!lexemes)
+                return nullptr;
+            auto &v = *lexemes;
+            if (cursor < v.size() && covers(v[cursor]))
+                return &v[cursor];
+
+            auto it = std::upper_bound(v.begin(), v.end(), pos, [](std::streamoff p, const lexeme &l) {
+                return p < l.skip_pos;
+            });
+            if (it == v.begin())
+                return nullptr;
+            --it;
+            if (!covers(*it))
+                return nullptr;
+            cursor = static_cast<size_t>(it - v.begin());
+            return &*it;
+        }
+    };
+
+    inline scanner *&active_scanner()
+    {
+        thread_local scanner *sc = nullptr;
+        return sc;
+    }
+
+    // Make a scanner active for the matchers of the current thread
+    struct scanner_scope
+    {
+        scanner *previous;
+
+        scanner_scope(scanner *sc) : previous(active_scanner())
+        {
+            active_scanner() = sc;
+        }
+        ~scanner_scope()
+        {
+            active_scanner() = previous;
+        }
+
+        scanner_scope(const scanner_scope &) = delete;
+        scanner_scope &operator=(const scanner_scope &) = delete;
+    };
+
+    inline std::optional<token_ptr> scanner_match(named_rule *r, std::istream &is) // Implementation
+    {
+        if (auto sc = active_scanner())
+            return sc->match(r, is);
+        return std::nullopt;
+    }
+
+    // Joins the threads still running when leaving the scope
+    struct thread_join_guard
+    {
+        std::vector<std::thread> &threads;
+
+        ~thread_join_guard()
+        {
+            for (auto &th : threads)
+            {
+                if (th.joinable())
+                    th.join();
+            }
+        }
+    };
+
+    // Visit every token after its children. Starting from root, the walk
+    // follows the child with the longest text (an estimate of the subtree
+    // size) until a token with at least
+    // max_threads children (e.g. the top level repeat) is found. Its
+    // children and the siblings left along the way are independent
+    // subtrees, visited in post-order by up to max_threads threads, so
+    // visitor must be safe to call concurrently on different subtrees. The
+    // tokens of the walk are visited last, on the calling thread.
+    template <typename TVisitor>
+    void parallel_visit(token &root, TVisitor visitor, size_t max_threads = std::thread::hardware_concurrency())
+    {
+        max_threads = std::max<size_t>(max_threads, 1);
+
+        std::vector<token *> walk({&root});
+        std::vector<token *> subtrees;
+        while (true)
+        {
+            token *t = walk.back();
+            token *widest = nullptr;
+            for (auto &c : t->children())
+            {
+                if (!widest || c->end_pos - c->start_pos > widest->end_pos - widest->start_pos)
+                    widest = c.get();
+            }
+            if (t->children().size() >= max_threads || !widest || widest->children().empty())
+            {
+                for (auto &c : t->children())
+                    subtrees.push_back(c.get());
+                break;
+            }
+            for (auto &c : t->children())
+            {
+                if (c.get() != widest)
+                    subtrees.push_back(c.get());
+            }
+            walk.push_back(widest);
+        }
+
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto worker = [&]() {
+            try
+            {
+                for (size_t i = next++; i < subtrees.size(); i = next++)
+                {
+                    for (auto &t : subtrees[i]->postorder())
+                        visitor(t);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = subtrees.size();
+            }
+        };
+
+        size_t threads = std::min(max_threads, subtrees.size());
+        std::vector<std::thread> pool;
+        {
+            // Started threads are joined even if starting another one throws
+            thread_join_guard guard{pool};
+            for (size_t i = 1; i < threads; i++)
+                pool.emplace_back(worker);
+            worker();
+        }
+        if (error)
+            std::rethrow_exception(error);
+
+        for (auto it = walk.rbegin(); it != walk.rend(); ++it)
+            visitor(**it);
+    }
 }
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <coroutine>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <array>
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "bnf.h"
+
+namespace bnf
+{
+    // Stream buffer over the bytes received so far, it records when a
+    // matcher tries to read past them
+    struct session_buf : public std::streambuf
+    {
+        bool hit_end = false;
+
+        void reset(char *data, size_t size)
+        {
+            setg(data, data, data + size);
+            hit_end = false;
+        }
+
+    protected:
+        int_type underflow() override
+        {
+            hit_end = true;
+            return traits_type::eof();
+        }
+
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+        {
+            if (!(which & std::ios_base::in))
+                return pos_type(off_type(-1));
+
+            off_type pos = off;
+            if (dir == std::ios_base::cur)
+                pos += gptr() - eback();
+            else if (dir == std::ios_base::end)
+                pos += egptr() - eback();
+            if (pos < 0 || pos > egptr() - eback())
+                return pos_type(off_type(-1));
+
+            setg(eback(), eback() + pos, egptr());
+            return pos_type(pos);
+        }
+
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+        {
+            return seekoff(off_type(pos), std::ios_base::beg, which);
+        }
+    };
+
+    // Single thread epoll loop resuming the coroutines waiting on a file descriptor
+    struct event_loop
+    {
+        int epoll_fd;
+        std::unordered_map<int, std::coroutine_handle<>> waiting;
+
+        event_loop() : epoll_fd(epoll_create1(EPOLL_CLOEXEC))
+        {
+            if (epoll_fd < 0)
+                throw std::system_error(errno, std::generic_category(), "epoll_create1");
+        }
+        ~event_loop()
+        {
+            // Destroying a coroutine can remove its descriptor from waiting
+            auto pending = std::move(waiting);
+            waiting.clear();
+            for (auto &w : pending)
+                w.second.destroy();
+            close(epoll_fd);
+        }
+
+        event_loop(const event_loop &) = delete;
+        event_loop &operator=(const event_loop &) = delete;
+
+        struct readable_awaiter
+        {
+            event_loop &loop;
+            int fd;
+
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) { loop.wait(fd, h); }
+            void await_resume() {}
+        };
+
+        // Suspend the calling coroutine until fd is readable
+        readable_awaiter readable(int fd)
+        {
+            return {*this, fd};
+        }
+
+        void wait(int fd, std::coroutine_handle<> h)
+        {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.fd = fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            {
+                if (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                    throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+            }
+            waiting[fd] = h;
+        }
+
+        void remove(int fd)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            waiting.erase(fd);
+        }
+
+        // Resume the coroutines whose descriptor is ready, waiting at most
+        // timeout milliseconds (-1 blocks). Returns the number of resumed coroutines.
+        size_t poll(int timeout)
+        {
+            std::array<epoll_event, 64> events;
+            int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), timeout);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    return 0;
+                throw std::system_error(errno, std::generic_category(), "epoll_wait");
+            }
+
+            size_t resumed = 0;
+            for (int i = 0; i < n; i++)
+            {
+                auto it = waiting.find(events[i].data.fd);
+                if (it == waiting.end())
+                    continue;
+                auto h = it->second;
+                waiting.erase(it);
+                h.resume();
+                resumed++;
+            }
+            return resumed;
+        }
+
+        // Run until no coroutine is waiting
+        void run()
+        {
+            while (!waiting.empty())
+                poll(-1);
+        }
+    };
+
+    // Fire and forget coroutine, the frame is released when the body returns.
+    // The body handles its own errors, an exception escaping it (e.g. thrown
+    // by an error handler) only ends that coroutine.
+    struct session_task
+    {
+        struct promise_type
+        {
+            session_task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() {}
+        };
+    };
+
+    // Removes the session descriptor from the loop when the session ends
+    struct session_registration
+    {
+        event_loop &loop;
+        int fd;
+
+        ~session_registration()
+        {
+            loop.remove(fd);
+        }
+    };
+
+    using token_handler = std::function<void(token &, std::string_view)>;
+    // Receives the input left unparsed and the exception that stopped the
+    // session, nullptr when the input does not match the rule
+    using error_handler = std::function<void(std::string_view, std::exception_ptr)>;
+
+    // Parse the data received on fd as a sequence of top level rules. Each
+    // completed top level token is passed to on_token together with its
+    // text (token positions are relative to the text) as soon as it is
+    // received. A match that reads past the received bytes is retried once
+    // the descriptor has been drained of the data that arrived meanwhile,
+    // so the session is suspended on the loop instead of blocking. Each
+    // retry restarts from the beginning of the pending message, max_pending
+    // bounds that work. The pending input and the tokens are allocated from
+    // resource.
+    // Parsing stops at end of file, at the first input r does not match,
+    // when more than max_pending bytes are pending without a complete
+    // token, or when an exception is thrown (by a handler, the resource or
+    // the loop); on_error then receives the pending input. The descriptor
+    // is switched to non-blocking mode and is not closed.
+    inline session_task parse_session(event_loop &loop, int fd, rule_base &r,
+                                      token_handler on_token,
+                                      error_handler on_error = {},
+                                      std::pmr::memory_resource *resource = std::pmr::get_default_resource(),
+                                      size_t max_pending = 1 << 20)
+    {
+        session_registration registration{loop, fd};
+        std::pmr::string buffer(resource);
+        size_t consumed = 0; // Bytes of buffer already passed to on_token
+        std::exception_ptr error;
+        bool failed = false;
+
+        try
+        {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+                throw std::system_error(errno, std::generic_category(), "fcntl");
+
+            session_buf sb;
+            std::istream is(&sb);
+            bool closed = false;
+            size_t attempted = 0; // Pending size of the last incomplete match
+
+            while (true)
+            {
+                // Read the available bytes
+                while (!closed && buffer.size() <= max_pending)
+                {
+                    char chunk[512];
+                    ssize_t n = read(fd, chunk, sizeof(chunk));
+                    if (n > 0)
+                        buffer.append(chunk, n);
+                    else if (n == 0)
+                        closed = true;
+                    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    else if (errno != EINTR)
+                        throw std::system_error(errno, std::generic_category(), "read");
+                }
+
+                // Emit the completed tokens
+                while (consumed < buffer.size())
+                {
+                    size_t pending = buffer.size() - consumed;
+                    if (!closed && pending == attempted)
+                        break; // Nothing new since the last incomplete match
+
+                    sb.reset(buffer.data() + consumed, pending);
+                    is.clear();
+                    token_ptr t;
+                    {
+                        memory_scope scope(resource);
+                        t = r.match(is);
+                    }
+                    if (sb.hit_end && !closed)
+                    {
+                        // Need more data
+                        attempted = pending;
+                        break;
+                    }
+
+                    if (!t || t->end_pos == t->start_pos)
+                    {
+                        failed = true;
+                        break;
+                    }
+
+                    size_t len = static_cast<size_t>(std::streamoff(t->end_pos));
+                    on_token(*t, std::string_view(buffer).substr(consumed, len));
+                    consumed += len;
+                    attempted = 0;
+                }
+                buffer.erase(0, consumed);
+                consumed = 0;
+
+                if (failed || closed)
+                    break;
+                if (buffer.size() > max_pending)
+                    throw std::length_error("bnf: pending input exceeds the session limit");
+                co_await loop.readable(fd);
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            failed = true;
+            buffer.erase(0, consumed);
+        }
+
+        if (failed && on_error)
+            on_error(buffer, error);
+    }
+}
@@ -1,7 +1,11 @@
 #include "gtest/gtest.h"
 
 #include <sstream>
+#include <set>
+#include <sys/socket.h>
+#include <sys/resource.h>
 #include "../bnf.h"
+#include "../bnf_async.h"
 
 TEST(Rule, Literal)
 {
@@ -33,3 +37,768 @@ TEST(Rule, Literal)
   ASSERT_EQ(fail_token, nullptr);
 }
 
+
+TEST(Memory, CountingResource)
+{
+  auto r_integer = bnf::make<bnf::rulew>("integer", bnf::make<bnf::more>(bnf::make<bnf::char_range>('0', '9')));
+
+  std::stringstream ss;
+  ss << " 12345 ";
+
+  bnf::counting_resource counter;
+  {
+    auto token = bnf::parse(*r_integer, ss, &counter);
+
+    ASSERT_NE(token, nullptr);
+    EXPECT_EQ(token->start_pos, 0);
+    EXPECT_EQ(token->end_pos, 7);
+    EXPECT_GT(counter.allocated, 0);
+    EXPECT_GT(counter.allocations, 0);
+  }
+  EXPECT_EQ(counter.allocated, 0);
+  EXPECT_GT(counter.peak, 0);
+}
+
+TEST(Memory, LimitExceeded)
+{
+  auto r_integer = bnf::make<bnf::rulew>("integer", bnf::make<bnf::more>(bnf::make<bnf::char_range>('0', '9')));
+
+  std::stringstream ss;
+  ss << "1234567890";
+
+  bnf::counting_resource counter(256);
+  auto token = bnf::parse(*r_integer, ss, &counter);
+
+  ASSERT_EQ(token, nullptr);
+  EXPECT_EQ(counter.allocated, 0);
+  EXPECT_EQ(ss.tellg(), 0);
+}
+
+TEST(Memory, StackBuffer)
+{
+  bnf::literal rule_foo("Foo");
+
+  std::stringstream ss;
+  ss << "Foo";
+
+  char buffer[1024];
+  bnf::counting_resource counter(0);
+  bnf::monotonic_resource monotonic(buffer, sizeof(buffer), &counter);
+
+  auto token = bnf::parse(rule_foo, ss, &monotonic);
+
+  ASSERT_NE(token, nullptr);
+  EXPECT_EQ(token->end_pos, 3);
+  EXPECT_EQ(counter.allocations, 0);
+}
+
+TEST(Memory, Pool)
+{
+  auto r_integer = bnf::make<bnf::rulew>("integer", bnf::make<bnf::more>(bnf::make<bnf::char_range>('0', '9')));
+
+  bnf::counting_resource counter;
+  bnf::pool_resource pool(&counter);
+
+  for (int i = 0; i < 3; i++)
+  {
+    std::stringstream ss;
+    ss << "42 ";
+
+    auto token = bnf::parse(*r_integer, ss, &pool);
+
+    ASSERT_NE(token, nullptr);
+    EXPECT_EQ(token->end_pos, 3);
+  }
+
+  EXPECT_GT(counter.allocated, 0);
+
+  pool.release();
+  EXPECT_EQ(counter.allocated, 0);
+}
+
+struct expr_grammar
+{
+  std::unique_ptr<bnf::rulew> r_integer = bnf::make<bnf::rulew>("integer", bnf::make<bnf::more>(bnf::make<bnf::char_range>('0', '9')));
+  std::unique_ptr<bnf::rulew> r_lparen = bnf::make<bnf::rulew>("lparen", bnf::make<bnf::literal>("("));
+  std::unique_ptr<bnf::rulew> r_rparen = bnf::make<bnf::rulew>("rparen", bnf::make<bnf::literal>(")"));
+  std::unique_ptr<bnf::rulew> r_mul = bnf::make<bnf::rulew>("mul", bnf::make<bnf::literal>("*"));
+  std::unique_ptr<bnf::rulew> r_add = bnf::make<bnf::rulew>("add", bnf::make<bnf::literal>("+"));
+  std::unique_ptr<bnf::rulew> r_expr = bnf::make<bnf::rulew>("expr");
+  std::unique_ptr<bnf::rulew> r_factor = bnf::make<bnf::rulew>("factor", bnf::make<bnf::choice>(r_integer->to_ref(),
+                                                                                                bnf::make<bnf::sequence>(r_lparen->to_ref(),
+                                                                                                                         r_expr->to_ref(),
+                                                                                                                         r_rparen->to_ref())));
+  std::unique_ptr<bnf::rulew> r_term = bnf::make<bnf::rulew>("term", bnf::make<bnf::sequence>(r_factor->to_ref(),
+                                                                                              bnf::make<bnf::any>(bnf::make<bnf::sequence>(r_mul->to_ref(),
+                                                                                                                                           r_factor->to_ref()))));
+
+  expr_grammar()
+  {
+    r_expr->child = bnf::make<bnf::sequence>(r_term->to_ref(),
+                                             bnf::make<bnf::any>(bnf::make<bnf::sequence>(r_add->to_ref(),
+                                                                                          r_term->to_ref())));
+  }
+};
+
+static std::string named_tokens(bnf::token *root)
+{
+  std::stringstream out;
+  for (auto &t : *root)
+  {
+    if (auto r = dynamic_cast<bnf::named_rule *>(t.rule))
+      out << r->name << " " << t.start_pos << "-" << t.end_pos << ";";
+  }
+  return out.str();
+}
+
+TEST(Scanner, Collect)
+{
+  expr_grammar g;
+  bnf::scanner sc(g.r_expr.get());
+
+  ASSERT_EQ(sc.entries.size(), 5);
+  EXPECT_EQ(sc.index.count(g.r_integer.get()), 1);
+  EXPECT_EQ(sc.index.count(g.r_add.get()), 1);
+  EXPECT_EQ(sc.index.count(g.r_factor.get()), 0);
+  EXPECT_TRUE(sc.entries[0].skip_whitespace);
+}
+
+TEST(Scanner, SameTokens)
+{
+  expr_grammar g;
+  bnf::scanner sc(g.r_expr.get());
+
+  std::stringstream ss;
+  ss << " 12 + (3 * 45) *6+7 ";
+
+  auto expected = g.r_expr->match(ss);
+  ASSERT_NE(expected, nullptr);
+
+  ss.clear();
+  ss.seekg(0);
+  sc.scan(ss);
+  EXPECT_EQ(sc.lexemes->size(), 11);
+  EXPECT_EQ(ss.tellg(), 0);
+
+  bnf::scanner_scope scope(&sc);
+  auto token = g.r_expr->match(ss);
+
+  ASSERT_NE(token, nullptr);
+  EXPECT_EQ(token->end_pos, expected->end_pos);
+  EXPECT_EQ(named_tokens(token.get()), named_tokens(expected.get()));
+}
+
+TEST(Scanner, LongestMatch)
+{
+  auto r_lt = bnf::make<bnf::rulea>("lt", bnf::make<bnf::literal>("<"));
+  auto r_le = bnf::make<bnf::rulea>("le", bnf::make<bnf::literal>("<="));
+  auto r_ident = bnf::make<bnf::rulew>("ident", bnf::make<bnf::more>(bnf::make<bnf::char_range>('a', 'z')));
+  auto r_if = bnf::make<bnf::rulew>("if", bnf::make<bnf::literal>("if"));
+
+  bnf::scanner sc({r_if.get(), r_ident.get(), r_lt.get(), r_le.get()});
+
+  std::stringstream ss;
+  ss << "if iffy<=<";
+  sc.scan(ss);
+
+  ASSERT_EQ(sc.lexemes->size(), 4);
+  EXPECT_EQ((*sc.lexemes)[0].rule, r_if.get());
+  EXPECT_EQ((*sc.lexemes)[1].rule, r_ident.get());
+  EXPECT_EQ((*sc.lexemes)[2].rule, r_le.get());
+  EXPECT_EQ((*sc.lexemes)[3].rule, r_lt.get());
+  EXPECT_EQ((*sc.lexemes)[1].skip_pos, 2);
+  EXPECT_EQ((*sc.lexemes)[1].start_pos, 3);
+  EXPECT_EQ((*sc.lexemes)[1].end_pos, 7);
+}
+
+TEST(Scanner, Fallback)
+{
+  expr_grammar g;
+  bnf::scanner sc(g.r_expr.get());
+
+  std::stringstream ss;
+  ss << "1 + 2 ? 3";
+  sc.scan(ss);
+  EXPECT_EQ(sc.lexemes->size(), 3);
+
+  bnf::scanner_scope scope(&sc);
+  auto token = g.r_integer->match(ss);
+  ASSERT_NE(token, nullptr);
+  EXPECT_EQ(token->end_pos, 2);
+
+  // Position not covered by the lexemes: direct match
+  ss.seekg(7);
+  token = g.r_integer->match(ss);
+  ASSERT_NE(token, nullptr);
+  EXPECT_EQ(token->start_pos, 7);
+
+  // Lexeme of another rule
+  ss.clear();
+  ss.seekg(1);
+  EXPECT_EQ(g.r_integer->match(ss), nullptr);
+  EXPECT_EQ(ss.tellg(), 1);
+}
+
+struct any_char : public bnf::terminal_rule
+{
+  bnf::token_ptr match(std::istream &is) override
+  {
+    auto t = match_begin(is);
+    char c;
+    if (!is.get(c))
+    {
+      is.clear();
+      match_fail(is, t.get());
+      return bnf::token::null_token();
+    }
+    match_passed(is, t.get());
+    return t;
+  }
+
+  std::string to_string() override
+  {
+    return ".";
+  }
+};
+
+TEST(Scanner, CustomTerminal)
+{
+  auto r_integer = bnf::make<bnf::rulea>("integer", bnf::make<bnf::more>(bnf::make<bnf::char_range>('0', '9')));
+  auto r_any = bnf::make<bnf::rulea>("any", bnf::make<any_char>());
+  auto r_pair = bnf::make<bnf::rulea>("pair", bnf::make<bnf::sequence>(r_any->to_ref(), r_integer->to_ref()));
+
+  bnf::scanner sc(r_pair.get());
+  ASSERT_EQ(sc.entries.size(), 1);
+  EXPECT_EQ(sc.entries[0].rule, r_integer.get());
+
+  std::stringstream ss;
+  ss << "512";
+  sc.scan(ss);
+
+  // "any" is matched directly even where the integer lexeme starts
+  bnf::scanner_scope scope(&sc);
+  auto token = r_pair->match(ss);
+  ASSERT_NE(token, nullptr);
+  EXPECT_EQ(token->end_pos, 3);
+}
+
+TEST(Scanner, Nullable)
+{
+  auto r_sign = bnf::make<bnf::rulea>("sign", bnf::make<bnf::opt>(bnf::make<bnf::char_set>("+-")));
+  auto r_integer = bnf::make<bnf::rulea>("integer", bnf::make<bnf::more>(bnf::make<bnf::char_range>('0', '9')));
+  auto r_num = bnf::make<bnf::rulea>("num", bnf::make<bnf::sequence>(r_sign->to_ref(), r_integer->to_ref()));
+
+  bnf::scanner sc(r_num.get());
+  ASSERT_EQ(sc.entries.size(), 2);
+  EXPECT_TRUE(sc.entries[0].nullable);
+  EXPECT_FALSE(sc.entries[1].nullable);
+
+  std::stringstream ss;
+  ss << "5";
+  auto expected = r_num->match(ss);
+  ASSERT_NE(expected, nullptr);
+
+  ss.clear();
+  ss.seekg(0);
+  sc.scan(ss);
+
+  bnf::scanner_scope scope(&sc);
+  auto token = r_num->match(ss);
+  ASSERT_NE(token, nullptr);
+  EXPECT_EQ(token->end_pos, expected->end_pos);
+  EXPECT_EQ(named_tokens(token.get()), named_tokens(expected.get()));
+}
+
+TEST(Scanner, MemoryLimit)
+{
+  expr_grammar g;
+  bnf::scanner sc(g.r_expr.get());
+
+  std::stringstream ss;
+  ss << "1";
+  for (int i = 0; i < 10000; i++)
+    ss << " + 2";
+
+  bnf::counting_resource counter(4096);
+  EXPECT_FALSE(sc.scan(ss, &counter));
+  EXPECT_FALSE(sc.lexemes.has_value());
+  EXPECT_EQ(counter.allocated, 0);
+  EXPECT_EQ(ss.tellg(), 0);
+
+  bnf::counting_resource unlimited;
+  {
+    bnf::memory_scope scope(&unlimited);
+    EXPECT_TRUE(sc.scan(ss));
+  }
+  EXPECT_EQ(sc.lexemes->size(), 20001);
+  EXPECT_GT(unlimited.peak, 40000);
+
+  // Give the lexemes back before the resource goes out of scope
+  sc.release();
+  EXPECT_EQ(unlimited.allocated, 0);
+}
+
+struct line_grammar : public expr_grammar
+{
+  std::unique_ptr<bnf::rulea> r_line = bnf::make<bnf::rulea>("line", bnf::make<bnf::sequence>(r_expr->to_ref(),
+                                                                                              bnf::make<bnf::literal>("\n")));
+};
+
+static void send_text(int fd, const std::string &text)
+{
+  ASSERT_EQ(write(fd, text.data(), text.size()), static_cast<ssize_t>(text.size()));
+}
+
+TEST(Async, Session)
+{
+  line_grammar g;
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  std::vector<std::string> lines;
+  std::string error;
+  bnf::parse_session(loop, fds[0], *g.r_line,
+                     [&](bnf::token &, std::string_view text) { lines.emplace_back(text); },
+                     [&](std::string_view text, std::exception_ptr) { error = text; });
+  EXPECT_EQ(loop.waiting.size(), 1);
+
+  send_text(fds[1], "1 + 2");
+  loop.poll(100);
+  EXPECT_TRUE(lines.empty());
+
+  send_text(fds[1], "3\n4 * (5");
+  loop.poll(100);
+  ASSERT_EQ(lines.size(), 1);
+  EXPECT_EQ(lines[0], "1 + 23\n");
+
+  send_text(fds[1], ")\n6\n");
+  loop.poll(100);
+  ASSERT_EQ(lines.size(), 3);
+  EXPECT_EQ(lines[1], "4 * (5)\n");
+  EXPECT_EQ(lines[2], "6\n");
+
+  close(fds[1]);
+  loop.run();
+  EXPECT_TRUE(loop.waiting.empty());
+  EXPECT_TRUE(error.empty());
+  close(fds[0]);
+}
+
+TEST(Async, Error)
+{
+  line_grammar g;
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  size_t count = 0;
+  std::string error;
+  std::exception_ptr exception;
+  bnf::parse_session(loop, fds[0], *g.r_line,
+                     [&](bnf::token &, std::string_view) { count++; },
+                     [&](std::string_view text, std::exception_ptr e) { error = text; exception = e; });
+
+  send_text(fds[1], "1\n2 + ?\n");
+  loop.run();
+
+  EXPECT_EQ(count, 1);
+  EXPECT_EQ(error, "2 + ?\n");
+  EXPECT_EQ(exception, nullptr);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Async, Multiplex)
+{
+  line_grammar g;
+  const size_t sessions = 1000;
+
+  // Two descriptors per session, raise the soft limit toward the hard one
+  rlimit limit;
+  ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+  const rlim_t needed = 2 * sessions + 64;
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed)
+  {
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed)
+      GTEST_SKIP() << "not enough file descriptors: " << limit.rlim_max;
+    limit.rlim_cur = needed;
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+  }
+  std::vector<std::array<int, 2>> fds(sessions);
+  std::vector<size_t> counts(sessions, 0);
+
+  bnf::event_loop loop;
+  for (size_t i = 0; i < sessions; i++)
+  {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i].data()), 0);
+    bnf::parse_session(loop, fds[i][0], *g.r_line,
+                       [&counts, i](bnf::token &, std::string_view) { counts[i]++; });
+  }
+
+  for (auto &f : fds)
+    send_text(f[1], "1 + ");
+  loop.poll(0);
+  for (auto &f : fds)
+  {
+    send_text(f[1], "2\n3\n");
+    close(f[1]);
+  }
+  loop.run();
+
+  for (size_t i = 0; i < sessions; i++)
+  {
+    EXPECT_EQ(counts[i], 2);
+    close(fds[i][0]);
+  }
+}
+
+static void preorder_reference(bnf::token *t, std::vector<bnf::token *> &out)
+{
+  out.push_back(t);
+  for (auto &c : t->children())
+    preorder_reference(c.get(), out);
+}
+
+static void postorder_reference(bnf::token *t, std::vector<bnf::token *> &out)
+{
+  for (auto &c : t->children())
+    postorder_reference(c.get(), out);
+  out.push_back(t);
+}
+
+static bnf::token_ptr parse_expr(expr_grammar &g, const std::string &text)
+{
+  std::stringstream ss;
+  ss << text;
+  return g.r_expr->match(ss);
+}
+
+TEST(Traversal, PreOrder)
+{
+  expr_grammar g;
+  auto root = parse_expr(g, "1 + (2 * 3) + 4");
+  ASSERT_NE(root, nullptr);
+
+  std::vector<bnf::token *> expected;
+  preorder_reference(root.get(), expected);
+
+  std::vector<bnf::token *> visited;
+  for (auto &t : root->preorder())
+    visited.push_back(&t);
+  EXPECT_EQ(visited, expected);
+
+  // Iteration over a subtree stops at its last descendant
+  bnf::token *sub = root->children().front()->children().back().get();
+  expected.clear();
+  preorder_reference(sub, expected);
+  visited.clear();
+  for (auto &t : *sub)
+    visited.push_back(&t);
+  EXPECT_EQ(visited, expected);
+}
+
+TEST(Traversal, Links)
+{
+  // Children can only be appended through add_child
+  static_assert(std::is_const_v<std::remove_reference_t<decltype(std::declval<bnf::token &>().children())>>);
+
+  auto root = bnf::token::create(std::pmr::get_default_resource());
+  root->add_child(bnf::token::create(std::pmr::get_default_resource()));
+  root->add_child(bnf::token::create(std::pmr::get_default_resource()));
+
+  bnf::token *second = root->children().back().get();
+  EXPECT_EQ(second->parent(), root.get());
+  EXPECT_EQ(second->index(), 1);
+  EXPECT_EQ(root->children().front()->next_sibling(), second);
+  EXPECT_EQ(second->next_sibling(), nullptr);
+
+  size_t count = 0;
+  for (auto &t : root->postorder())
+  {
+    (void)t;
+    count++;
+  }
+  EXPECT_EQ(count, 3);
+}
+
+TEST(Traversal, PostOrder)
+{
+  expr_grammar g;
+  auto root = parse_expr(g, "1 + (2 * 3) + 4");
+  ASSERT_NE(root, nullptr);
+
+  std::vector<bnf::token *> expected;
+  postorder_reference(root.get(), expected);
+
+  std::vector<bnf::token *> visited;
+  for (auto &t : root->postorder())
+    visited.push_back(&t);
+  EXPECT_EQ(visited, expected);
+}
+
+TEST(Traversal, SkipChildren)
+{
+  expr_grammar g;
+  auto root = parse_expr(g, "1 + (2 * 3) + 4");
+  ASSERT_NE(root, nullptr);
+
+  // Visit the named rules, without entering them
+  std::vector<std::string> names;
+  for (auto it = root->begin(); it != root->end();)
+  {
+    auto r = dynamic_cast<bnf::named_rule *>(it->rule);
+    if (r && it->parent())
+    {
+      names.push_back(r->name);
+      it.skip_children();
+    }
+    else
+      ++it;
+  }
+  EXPECT_EQ(names, std::vector<std::string>({"term", "add", "term", "add", "term"}));
+}
+
+TEST(Traversal, ParallelVisit)
+{
+  expr_grammar g;
+  // Leading whitespace makes a token with many children beside the body
+  std::string text = "        1";
+  for (int i = 0; i < 500; i++)
+    text += " + (2 * 3 + " + std::to_string(i) + ")";
+  auto root = parse_expr(g, text);
+  ASSERT_NE(root, nullptr);
+
+  std::vector<bnf::token *> nodes;
+  preorder_reference(root.get(), nodes);
+  std::unordered_map<bnf::token *, size_t> order;
+  for (auto t : nodes)
+    order[t] = 0;
+
+  std::atomic<size_t> sequence(0);
+  std::mutex threads_mutex;
+  std::set<std::thread::id> threads;
+  bnf::parallel_visit(*root, [&](bnf::token &t) {
+    order.at(&t) = ++sequence;
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    threads.insert(std::this_thread::get_id());
+  }, 4);
+
+  EXPECT_EQ(sequence, nodes.size());
+  for (auto t : nodes)
+  {
+    EXPECT_GT(order[t], 0);
+    if (t->parent())
+    {
+      EXPECT_LT(order[t], order[t->parent()]);
+    }
+  }
+  EXPECT_LE(threads.size(), 4);
+  EXPECT_GT(threads.size(), 1);
+}
+
+TEST(Async, HandlerException)
+{
+  line_grammar g;
+  int bad[2];
+  int good[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, bad), 0);
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, good), 0);
+
+  bnf::event_loop loop;
+  std::string error;
+  std::exception_ptr exception;
+  bnf::parse_session(loop, bad[0], *g.r_line,
+                     [](bnf::token &, std::string_view) { throw std::runtime_error("handler"); },
+                     [&](std::string_view text, std::exception_ptr e) { error = text; exception = e; });
+  size_t count = 0;
+  bnf::parse_session(loop, good[0], *g.r_line,
+                     [&](bnf::token &, std::string_view) { count++; });
+
+  send_text(bad[1], "1\n2\n");
+  send_text(good[1], "1\n");
+  loop.poll(100);
+  EXPECT_EQ(loop.waiting.size(), 1);
+  EXPECT_EQ(error, "1\n2\n");
+  ASSERT_NE(exception, nullptr);
+  EXPECT_THROW(std::rethrow_exception(exception), std::runtime_error);
+
+  send_text(good[1], "2\n");
+  close(good[1]);
+  loop.run();
+  EXPECT_EQ(count, 2);
+
+  for (int fd : {bad[0], bad[1], good[0]})
+    close(fd);
+}
+
+TEST(Async, PendingLimit)
+{
+  line_grammar g;
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  std::exception_ptr exception;
+  bnf::parse_session(loop, fds[0], *g.r_line,
+                     [](bnf::token &, std::string_view) {},
+                     [&](std::string_view, std::exception_ptr e) { exception = e; },
+                     std::pmr::get_default_resource(), 1024);
+
+  std::string text = "1";
+  for (int i = 0; i < 1000; i++)
+    text += "+1";
+  send_text(fds[1], text);
+  loop.run();
+
+  ASSERT_NE(exception, nullptr);
+  EXPECT_THROW(std::rethrow_exception(exception), std::length_error);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Async, MemoryLimit)
+{
+  line_grammar g;
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  bnf::counting_resource counter(4096);
+  std::exception_ptr exception;
+  bnf::parse_session(loop, fds[0], *g.r_line,
+                     [](bnf::token &, std::string_view) {},
+                     [&](std::string_view, std::exception_ptr e) { exception = e; },
+                     &counter);
+
+  std::string text = "1";
+  for (int i = 0; i < 1000; i++)
+    text += "+1";
+  send_text(fds[1], text);
+  loop.run();
+
+  ASSERT_NE(exception, nullptr);
+  EXPECT_THROW(std::rethrow_exception(exception), bnf::memory_limit_exceeded);
+  EXPECT_EQ(counter.allocated, 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+struct counting_rule : public bnf::rule_base
+{
+  bnf::rule_base &inner;
+  size_t calls = 0;
+
+  counting_rule(bnf::rule_base &in_inner) : inner(in_inner) {}
+
+  bnf::token_ptr match(std::istream &is) override
+  {
+    calls++;
+    return inner.match(is);
+  }
+
+  std::string to_string() override
+  {
+    return inner.to_string();
+  }
+};
+
+static std::string long_expr(size_t terms)
+{
+  std::string text = "1";
+  for (size_t i = 0; i < terms; i++)
+    text += "+1";
+  return text;
+}
+
+TEST(Async, LongLine)
+{
+  line_grammar g;
+  counting_rule r_counted(*g.r_line);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  std::vector<size_t> lengths;
+  bnf::parse_session(loop, fds[0], r_counted,
+                     [&](bnf::token &, std::string_view text) { lengths.push_back(text.size()); });
+
+  // Data received between two wake ups is matched once
+  std::string chunk = long_expr(100);
+  for (int i = 0; i < 30; i++)
+    send_text(fds[1], chunk);
+  loop.poll(100);
+  EXPECT_TRUE(lengths.empty());
+  EXPECT_EQ(r_counted.calls, 1);
+
+  send_text(fds[1], chunk);
+  loop.poll(100);
+  EXPECT_EQ(r_counted.calls, 2);
+
+  send_text(fds[1], "\n");
+  loop.poll(100);
+  ASSERT_EQ(lengths.size(), 1);
+  EXPECT_EQ(lengths[0], 31 * chunk.size() + 1);
+
+  close(fds[1]);
+  loop.run();
+  close(fds[0]);
+}
+
+TEST(Async, SplitMessage)
+{
+  line_grammar g;
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  std::vector<size_t> lengths;
+  bnf::parse_session(loop, fds[0], *g.r_line,
+                     [&](bnf::token &, std::string_view text) { lengths.push_back(text.size()); });
+
+  // A line over 4 KB in two writes, the peer keeps the connection open
+  std::string text = long_expr(2100) + "\n";
+  send_text(fds[1], text.substr(0, 4100));
+  loop.poll(50);
+  EXPECT_TRUE(lengths.empty());
+
+  send_text(fds[1], text.substr(4100));
+  for (int i = 0; i < 10 && lengths.empty(); i++)
+    loop.poll(50);
+  ASSERT_EQ(lengths.size(), 1);
+  EXPECT_EQ(lengths[0], text.size());
+
+  close(fds[1]);
+  loop.run();
+  close(fds[0]);
+}
+
+TEST(Async, PendingInPieces)
+{
+  line_grammar g;
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  bnf::event_loop loop;
+  size_t count = 0;
+  std::exception_ptr exception;
+  bnf::parse_session(loop, fds[0], *g.r_line,
+                     [&](bnf::token &, std::string_view) { count++; },
+                     [&](std::string_view, std::exception_ptr e) { exception = e; },
+                     std::pmr::get_default_resource(), 2048);
+
+  // A message under the limit is accepted whatever its pieces
+  std::string text = long_expr(800) + "\n";
+  for (size_t pos = 0; pos < text.size(); pos += 500)
+  {
+    send_text(fds[1], text.substr(pos, 500));
+    loop.poll(50);
+  }
+  EXPECT_EQ(count, 1);
+  EXPECT_EQ(exception, nullptr);
+
+  close(fds[1]);
+  loop.run();
+  EXPECT_EQ(exception, nullptr);
+  close(fds[0]);
+}